@@ -2,6 +2,7 @@ let gateway = `ws://${window.location.hostname}/ws`;
 let websocket, ping_setinterval, ping_settimeout;
 let history = localStorage.getItem("history") || {};
 let start_time = 0, dispinterval;
+let event_seq = 0, event_epoch, replay_pending = false;
 let banner_timeout = 2000, ping_timeout = 5000, ws_timeout = 2000;
 
 function format_us(t_start, t) {
@@ -16,6 +17,51 @@ function format_us(t_start, t) {
     );
 }
 
+function update_leaderboard(doc) {
+    let rows = doc["riders"].map((r, i) =>
+        `<tr><td>${i + 1}</td><td>${r["id"]}</td><td>${format_us(0, r["best"])}</td>` +
+        `<td>${i ? "+" + format_us(0, r["gap"]) : ""}</td><td>${format_us(0, r["avg"])}</td><td>${r["runs"]}</td></tr>`);
+    $("#leaderboard tbody").html(rows.join(""));
+    $("#session-stats").html(doc["runs"] ?
+        `Runs ${doc["runs"]} | Median ${format_us(0, doc["median"])} | P90 ${format_us(0, doc["p90"])}` +
+        (doc["full"] ? " | Session full, median and P90 frozen" : "") : "");
+    let last = doc["last"];
+    $("#last-run").html(last ?
+        `Rider ${last["rider"]}: ${format_us(0, last["time"])} | Rank ${last["rank"]}` +
+        (last["gap"] ? ` | +${format_us(0, last["gap"])}` : "") + (last["pb"] ? " | PB" : "") : "");
+}
+
+function request_replay() {
+    replay_pending = true;
+    websocket.send(JSON.stringify({ "replay": event_seq, "epoch": event_epoch }));
+}
+
+function handle_events(doc) {
+    if (doc["replay"]) replay_pending = false;
+    if (doc["epoch"] != event_epoch) {
+        event_epoch = doc["epoch"];
+        event_seq = 0;
+    }
+    let events = doc["events"].filter((ev) => ev["seq"] > event_seq);
+    if (events.length && event_seq && events[0]["seq"] > event_seq + 1 && !doc["truncated"]) {
+        if (!replay_pending) request_replay();
+        return;
+    }
+    // Only the last finish is shown, and not if a later start means a run is
+    // already in progress.
+    let finish = events.filter((ev) => ev["type"] == "finish").pop();
+    let running = events.some((ev) => ev["type"] == "start" && (!finish || ev["seq"] > finish["seq"]));
+    if (finish && !running) {
+        if (dispinterval !== undefined) {
+            clearInterval(dispinterval);
+            dispinterval = undefined;
+        }
+        $("#display").html(format_us(0, finish["duration"]));
+        $("#display-micros").html(finish["duration"]);
+    }
+    if (events.length) event_seq = events[events.length - 1]["seq"];
+}
+
 function init_websocket() {
     websocket = new WebSocket(gateway);
     websocket.onopen = (e) => {
@@ -25,6 +71,8 @@ function init_websocket() {
         setTimeout(() => {
             $(".alert-success").addClass("d-none");
         }, banner_timeout);
+        websocket.send(JSON.stringify({ "leaderboard": true }));
+        request_replay();
         ping_setinterval = setInterval(() => {
             websocket.send('__ping__');
             ping_settimeout = setTimeout(() => {
@@ -52,6 +100,14 @@ function init_websocket() {
             return;
         }
         let doc = JSON.parse(e.data);
+        if (doc["msg"] == "leaderboard") {
+            update_leaderboard(doc);
+            return;
+        } else if (doc["msg"] == "events") {
+            handle_events(doc);
+            return;
+        }
+        if (doc["event_seq"] > event_seq && !replay_pending) request_replay();
         $("#data").html(`<pre>${JSON.stringify(doc, false, 1).replace(/[\{\}\",]/g, '')}</pre>`);
         $("#mode-dropdown ul li a.active").removeClass("active");
         $(`#mode-dropdown ul li a[data-value='${doc["mode"]}']`).addClass("active");
@@ -61,8 +117,11 @@ function init_websocket() {
         $("#threshold-slider").val(doc["adc_threshold"]);
         $("#intensity-value").html(doc["intensity"]);
         $("#threshold-value").html(doc["adc_threshold"]);
+        $("#lockin-threshold-slider").val(doc["lockin_threshold"]);
+        $("#lockin-threshold-value").html(doc["lockin_threshold"]);
         $("#lockout-slider").val(doc["beam_cross_lockout_ms"]);
         $("#lockout-value").html(doc["beam_cross_lockout_ms"]);
+        if (document.activeElement.id != "rider-input") $("#rider-input").val(doc["rider"]);
 
         // if (doc["start"] != 0 && doc["finish"] == 0 && dispinterval === undefined) {
         if (doc["msg"] == "running" && dispinterval === undefined) {
@@ -110,11 +169,22 @@ $(document).ready(() => {
         $("#threshold-value").html(selected_threshold);
         websocket.send(JSON.stringify({ "adc_threshold": selected_threshold }));
     });
+    $('#lockin-threshold-slider').on('change', (e) => {
+        let selected_threshold = e.target.value;
+        $("#lockin-threshold-value").html(selected_threshold);
+        websocket.send(JSON.stringify({ "lockin_threshold": selected_threshold }));
+    });
     $('#lockout-slider').on('change', (e) => {
         let selected_lockout = e.target.value;
         $("#lockout-value").html(selected_lockout);
         websocket.send(JSON.stringify({ "beam_cross_lockout_ms": selected_lockout }));
     });
+    $('#rider-input').on('change', (e) => {
+        websocket.send(JSON.stringify({ "rider": Number(e.target.value) }));
+    });
+    $('#reset-session').on('click', (e) => {
+        websocket.send(JSON.stringify({ "reset_session": true }));
+    });
     $('#lockout-enable').on('change', (e) => {
         $("#lockout-slider").attr("disabled", !e.target.checked);
         $("#crossings-dropdown button").toggleClass("disabled", !e.target.checked);
@@ -3,6 +3,7 @@
 
 #include <Arduino.h>
 
+#include "lockin.h"
 #include "pins.h"
 
 #define IR_PULSE_HIGH_TIME_US 100000
@@ -22,11 +23,13 @@
 #define POLL_BEAM_TIMER_INTERVAL_DIG 100
 #define POLL_BEAM_TIMER_INTERVAL_ADC 500
 #define POLL_BEAM_TIMER_INTERVAL_IR 10000
+#define POLL_BEAM_TIMER_INTERVAL_IDLE 2000  // floor while in idle power mode
 
 enum detection_mode_t {
   LASER_PHOTOTRANS_DIG,
   LASER_PHOTOTRANS_ADC,
   LASER_IR_RECV,
+  LASER_PHOTOTRANS_LOCKIN,
   INVALID,
 };
 
@@ -52,10 +55,17 @@ struct beam_t {
   unsigned long adc_sample_time = 0;  // time specifically for adc read
   volatile unsigned int adc_value = 0;
   unsigned long beam_cross_lockout_ms = 0;
+  lockin_t lockin;
+  unsigned int lockin_threshold = 0;  // on-minus-off amplitude, not brightness
+  volatile bool idle = false;         // polling at the idle rate
+  volatile unsigned long wake_time = 0;  // interruption that ended idle
+  TaskHandle_t wake_task = NULL;      // notified on that interruption
 };
 
 void init_beam(beam_t *beam);
 void reset_beam();
+void set_beam_idle(bool idle);
+unsigned long beam_poll_interval(detection_mode_t mode, bool idle = false);
 detection_mode_t str_to_detection_mode(const char *str);
 const char *detection_mode_to_str(detection_mode_t mode);
 uint16_t IRAM_ATTR local_adc1_read(int channel);
@@ -64,5 +74,6 @@ void IRAM_ATTR ISR_ir_recv_state_change();
 void IRAM_ATTR ISR_poll_beam();
 void IRAM_ATTR ISR_phototrans_recv_state_change();
 void IRAM_ATTR update_beam_state(bool recv, unsigned long t);
+void IRAM_ATTR lockin_sample(unsigned long t);
 
 #endif
\ No newline at end of file
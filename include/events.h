@@ -0,0 +1,36 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <AsyncWebSocket.h>
+
+#include "debug.h"
+
+#define EVENT_RING_SIZE 64
+#define EVENT_DOC_SIZE 6144
+
+enum event_type_t {
+  EVENT_START,
+  EVENT_CROSSING,
+  EVENT_FINISH,
+};
+
+struct event_t {
+  unsigned long seq = 0;
+  event_type_t type = EVENT_START;
+  unsigned long time = 0;
+  unsigned int counter = 0;
+  unsigned long duration = 0;  // finish only
+};
+
+void init_events();
+void IRAM_ATTR push_event(event_type_t type, unsigned long time,
+                          unsigned int counter, unsigned long duration = 0);
+unsigned long events_head();
+unsigned long events_epoch();
+AsyncWebSocketSharedBuffer events_snapshot(unsigned long after,
+                                           bool replay = false);
+const char *event_type_to_str(event_type_t type);
+
+#endif
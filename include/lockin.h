@@ -0,0 +1,39 @@
+#ifndef LOCKIN_H
+#define LOCKIN_H
+
+// Lock-in demodulator for LASER_PHOTOTRANS_LOCKIN. The poll timer fires every
+// half period, samples the phototransistor at the end of the current laser
+// phase, then toggles the laser. On-minus-off is averaged over
+// LOCKIN_WINDOW_PERIODS full periods, which cancels ambient light (sun, lamps)
+// that is constant over a period.
+#define LOCKIN_HALF_PERIOD_US 250  // 2 kHz modulation
+#define LOCKIN_WINDOW_PERIODS 4    // 2 ms detection latency
+
+struct lockin_t {
+  bool laser_on = false;
+  unsigned int half_periods = 0;
+  long sum = 0;    // sum of (on - off) samples in the current window
+  long value = 0;  // demodulated beam amplitude of the last window
+};
+
+inline void lockin_reset(lockin_t *lockin) {
+  lockin->half_periods = 0;
+  lockin->sum = 0;
+  lockin->value = 0;
+}
+
+// Adds a sample taken at the end of the current laser phase and flips the
+// phase; the caller drives the laser from lockin->laser_on afterwards. Returns
+// true when a window completes and lockin->value is updated. A window always
+// holds as many on samples as off samples, so any constant light level cancels.
+inline bool lockin_accumulate(lockin_t *lockin, int sample) {
+  lockin->sum += lockin->laser_on ? sample : -sample;
+  lockin->laser_on = !lockin->laser_on;
+  if (++lockin->half_periods < 2 * LOCKIN_WINDOW_PERIODS) return false;
+  lockin->value = lockin->sum / LOCKIN_WINDOW_PERIODS;
+  lockin->sum = 0;
+  lockin->half_periods = 0;
+  return true;
+}
+
+#endif
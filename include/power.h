@@ -0,0 +1,42 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <Arduino.h>
+
+#include "beam.h"
+#include "debug.h"
+
+#define POWER_IDLE_TIMEOUT_MS 60000  // no run for this long enters idle
+#define POWER_ACTIVE_CPU_MHZ 240
+#define POWER_IDLE_CPU_MHZ 80  // lowest clock that keeps WiFi up
+#define POWER_IDLE_UPDATE_MS 1000  // client status period while idle
+
+// Nominal board draw used for the battery estimate; measure your own gate
+// (display and laser included) and adjust. Nothing is measured at runtime,
+// so the estimate only reflects the active/idle split.
+#define POWER_ACTIVE_MA 180
+#define POWER_IDLE_MA 90
+#define POWER_BATTERY_MAH 10000
+
+struct power_t {
+  bool idle = false;
+  unsigned long last_activity_ms = 0;
+  unsigned long state_since_ms = 0;
+  unsigned long active_ms = 0;  // accumulated time in each state
+  unsigned long idle_ms = 0;
+  unsigned long enter_idle_us = 0;  // duration of the last transitions
+  unsigned long exit_idle_us = 0;
+  unsigned long wake_latency_us = 0;  // interruption to full-rate polling
+  unsigned long max_wake_latency_us = 0;
+  unsigned long worst_start_latency_us = 0;  // at the current poll rate
+  unsigned long min_interruption_us = 0;  // shorter ones may go undetected
+};
+
+void init_power(power_t *power, beam_t *beam);
+void power_activity();
+void power_update();
+void power_enter_idle();
+void power_exit_idle();
+float power_battery_hours();
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <AsyncWebSocket.h>
+
+#include "debug.h"
+
+#define SESSION_MAX_RUNS 512
+#define SESSION_MAX_RIDERS 64
+#define SESSION_LEADERBOARD_SIZE 10
+#define SESSION_SNAPSHOT_DOC_SIZE 2048
+
+void init_session();
+void reset_session();
+void set_session_rider(unsigned int rider);
+unsigned int get_session_rider();
+void session_record_run(unsigned long duration);
+AsyncWebSocketSharedBuffer session_snapshot();
+
+#endif
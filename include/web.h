@@ -13,6 +13,7 @@
 #include <esp_wifi.h>
 
 #include "debug.h"
+#include "ws_throttle.h"
 
 #if __has_include("wifi_credentials.h")
 #include "wifi_credentials.h"
@@ -23,15 +24,30 @@
 
 #define WIFI_SOFT_AP 0
 #define WIFI_SOFT_AP_SSID "MGK Lap Timer"
+#define WIFI_STA_TIMEOUT_MS 15000  // then fall back to the soft AP
 #define MDNS_NAME "mgktimer"
 #define HTTP_PORT 80
 #define WEBSOCKET_NAME "/ws"
+#define NETWORK_TASK_CORE 0
+#define NETWORK_TASK_PRI 1
+#define NETWORK_TASK_STACK 8192
+#define NETWORK_TASK_POLL_MS 10
 
 void init_fs();
 
 void init_wifi(DNSServer *dns_server);
+void init_network(DNSServer *dns_server, AsyncWebServer *server,
+                  AsyncWebSocket *socket,
+                  void (*cb)(AsyncWebSocketClient *client,
+                             StaticJsonDocument<512> doc));
+unsigned long network_ready_time();
 void init_webserver(AsyncWebServer *server, AsyncWebSocket *socket,
-                    void (*cb)(StaticJsonDocument<512> doc));
+                    void (*cb)(AsyncWebSocketClient *client,
+                               StaticJsonDocument<512> doc));
+AsyncWebSocketSharedBuffer ws_serialize(JsonDocument &doc);
+void ws_broadcast(AsyncWebSocket *socket, AsyncWebSocketSharedBuffer buffer,
+                  bool essential = false);
+size_t ws_throttled_clients();
 void ws_event_handler(AsyncWebSocket *server, AsyncWebSocketClient *client,
                       AwsEventType type, void *arg, uint8_t *data, size_t len);
 
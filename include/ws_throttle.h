@@ -0,0 +1,79 @@
+#ifndef WS_THROTTLE_H
+#define WS_THROTTLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-client WebSocket fan-out policy. A client whose send queue is at or
+// above WS_CLIENT_QUEUE_CONGESTED has its update rate halved, down to one in
+// WS_CLIENT_MAX_DIVISOR updates; it regains rate once its queue drains to
+// WS_CLIENT_QUEUE_HEALTHY. Regular updates are full state, so a skipped one is
+// simply superseded by the next. Essential messages (finish, leaderboard,
+// events) are never skipped: while the client is congested they wait in a FIFO
+// of WS_CLIENT_PENDING_MAX and go out in order once it drains.
+#define WS_MAX_CLIENTS 16
+#define WS_CLIENT_QUEUE_HEALTHY 1
+#define WS_CLIENT_QUEUE_CONGESTED 4
+#define WS_CLIENT_MAX_DIVISOR 16
+#define WS_CLIENT_PENDING_MAX 8
+
+template <typename buffer_t>
+struct ws_throttle_t {
+  uint8_t divisor = 1;
+  uint8_t ticks = 0;
+  uint8_t pending_head = 0;
+  uint8_t pending_count = 0;
+  unsigned long dropped = 0;  // essential messages lost to a full FIFO
+  buffer_t pending[WS_CLIENT_PENDING_MAX];
+};
+
+template <typename buffer_t>
+void ws_throttle_push(ws_throttle_t<buffer_t> *t, const buffer_t &buffer) {
+  if (t->pending_count == WS_CLIENT_PENDING_MAX) {
+    t->pending[t->pending_head] = buffer_t();
+    t->pending_head = (t->pending_head + 1) % WS_CLIENT_PENDING_MAX;
+    t->pending_count--;
+    t->dropped++;
+  }
+  t->pending[(t->pending_head + t->pending_count) % WS_CLIENT_PENDING_MAX] =
+      buffer;
+  t->pending_count++;
+}
+
+// Decides what to queue to one client for one update, given the depth of its
+// send queue. Writes up to WS_CLIENT_PENDING_MAX + 1 buffers to `out`, oldest
+// first, and returns how many.
+template <typename buffer_t>
+size_t ws_throttle_update(ws_throttle_t<buffer_t> *t, size_t depth,
+                          const buffer_t &buffer, bool essential,
+                          buffer_t *out) {
+  if (depth >= WS_CLIENT_QUEUE_CONGESTED) {
+    if (t->divisor < WS_CLIENT_MAX_DIVISOR) t->divisor *= 2;
+    if (essential) ws_throttle_push(t, buffer);
+    return 0;
+  }
+  if (depth <= WS_CLIENT_QUEUE_HEALTHY && t->divisor > 1) t->divisor /= 2;
+
+  size_t n = 0;
+  while (t->pending_count && depth + n < WS_CLIENT_QUEUE_CONGESTED) {
+    out[n++] = t->pending[t->pending_head];
+    t->pending[t->pending_head] = buffer_t();
+    t->pending_head = (t->pending_head + 1) % WS_CLIENT_PENDING_MAX;
+    t->pending_count--;
+  }
+
+  if (essential) {
+    if (t->pending_count || depth + n >= WS_CLIENT_QUEUE_CONGESTED) {
+      ws_throttle_push(t, buffer);
+    } else {
+      out[n++] = buffer;
+    }
+  } else if (++t->ticks >= t->divisor && !t->pending_count &&
+             depth + n < WS_CLIENT_QUEUE_CONGESTED) {
+    t->ticks = 0;
+    out[n++] = buffer;
+  }
+  return n;
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <soc/sens_struct.h>
 
 #include "debug.h"
+#include "events.h"
 
 static hw_timer_t *ir_pulse_train_timer = NULL, *poll_beam_timer = NULL;
 static portMUX_TYPE ir_pulse_train_spinlock = portMUX_INITIALIZER_UNLOCKED;
@@ -22,6 +23,7 @@ void reset_beam() {
   beam_ptr->sample_rate = 0;
   beam_ptr->state = NOT_ESTABLISHED;
   beam_ptr->adc_value = 0;
+  lockin_reset(&beam_ptr->lockin);
 }
 
 void init_beam(beam_t *beam) {
@@ -61,32 +63,63 @@ void init_beam(beam_t *beam) {
 
       ledcAttachPin(LASER_PIN, IR_PULSE_TRAIN_PWM_CHANNEL);
 
-      timerAlarmWrite(poll_beam_timer, POLL_BEAM_TIMER_INTERVAL_IR, true);
-
       LOGF("IR Receiver configured\n");
       break;
 
     case LASER_PHOTOTRANS_DIG:
       digitalWrite(LASER_PIN, HIGH);
-
-      timerAlarmWrite(poll_beam_timer, POLL_BEAM_TIMER_INTERVAL_DIG, true);
       LOGF("Laser phototransistor dig recv configured\n");
       break;
 
     case LASER_PHOTOTRANS_ADC:
       digitalWrite(LASER_PIN, HIGH);
       analogRead(PHOTOTRANS_PIN);
-      timerAlarmWrite(poll_beam_timer, POLL_BEAM_TIMER_INTERVAL_ADC, true);
       LOGF("Laser phototransistor adc recv configured\n");
       break;
+
+    case LASER_PHOTOTRANS_LOCKIN:
+      beam_ptr->lockin.laser_on = false;
+      digitalWrite(LASER_PIN, LOW);
+      analogRead(PHOTOTRANS_PIN);
+      LOGF("Laser phototransistor lock-in recv configured\n");
+      break;
   }
 
+  beam_ptr->idle = false;
+  timerAlarmWrite(poll_beam_timer, beam_poll_interval(beam_ptr->mode), true);
   timerAttachInterrupt(poll_beam_timer, ISR_poll_beam, true);
   timerAlarmEnable(poll_beam_timer);
   LOGF("Poll beam timer enabled: %d\n", timerAlarmEnabled(poll_beam_timer));
 
   reset_beam();
 }
+
+unsigned long beam_poll_interval(detection_mode_t mode, bool idle) {
+  unsigned long interval;
+  switch (mode) {
+    case LASER_IR_RECV:
+      interval = POLL_BEAM_TIMER_INTERVAL_IR;
+      break;
+    case LASER_PHOTOTRANS_DIG:
+      interval = POLL_BEAM_TIMER_INTERVAL_DIG;
+      break;
+    case LASER_PHOTOTRANS_LOCKIN:
+      // The poll timer is also the modulation clock, so it never slows down.
+      return LOCKIN_HALF_PERIOD_US;
+    default:
+      interval = POLL_BEAM_TIMER_INTERVAL_ADC;
+      break;
+  }
+  return idle ? max(interval, (unsigned long)POLL_BEAM_TIMER_INTERVAL_IDLE)
+              : interval;
+}
+
+void set_beam_idle(bool idle) {
+  timerAlarmWrite(poll_beam_timer, beam_poll_interval(beam_ptr->mode, idle),
+                  true);
+  beam_ptr->idle = idle;
+}
+
 void IRAM_ATTR ISR_poll_beam() {
   portENTER_CRITICAL_ISR(&recv_isr_spinlock);
   bool recv;
@@ -105,6 +138,10 @@ void IRAM_ATTR ISR_poll_beam() {
       update_beam_state(recv, t);
       break;
 
+    case LASER_PHOTOTRANS_LOCKIN:
+      lockin_sample(t);
+      break;
+
     case LASER_IR_RECV:
       if ((t % IR_PULSE_PERIOD_US) <= IR_PULSE_HIGH_TIME_US) {
         recv = !digitalRead(IR_RECV_PIN);
@@ -129,13 +166,22 @@ void IRAM_ATTR update_beam_state(bool recv, unsigned long t) {
 
   if (beam_ptr->state == RECEIVED && !recv && !beam_ptr->counter) {
     beam_ptr->start_time = t;
+    push_event(EVENT_START, t, 0);
+    if (beam_ptr->idle && beam_ptr->wake_task) {
+      beam_ptr->idle = false;
+      beam_ptr->wake_time = t;
+      vTaskNotifyGiveFromISR(beam_ptr->wake_task, NULL);
+    }
   } else if (beam_ptr->state == INTERRUPTED && recv) {
     beam_ptr->counter++;
     beam_ptr->state = LOCKOUT;
-  }
+    push_event(EVENT_CROSSING, t, beam_ptr->counter);
 
-  if (beam_ptr->counter && !(beam_ptr->counter % beam_ptr->crossings)) {
-    beam_ptr->finish_time = t;
+    // Only on the crossing itself, not on every sample until the next reset.
+    if (!(beam_ptr->counter % beam_ptr->crossings)) {
+      beam_ptr->finish_time = t;
+      push_event(EVENT_FINISH, t, beam_ptr->counter, t - beam_ptr->start_time);
+    }
   }
 
   beam_ptr->state = recv ? RECEIVED : INTERRUPTED;
@@ -143,6 +189,21 @@ void IRAM_ATTR update_beam_state(bool recv, unsigned long t) {
   digitalWrite(STATUS_LED_PIN, recv);
 }
 
+void IRAM_ATTR lockin_sample(unsigned long t) {
+  // Sample at the end of the current phase so the phototransistor has settled,
+  // then flip the laser for the next half period.
+  int v = analogRead(PHOTOTRANS_PIN);
+  beam_ptr->adc_sample_time = micros() - t;
+  beam_ptr->adc_value = v;
+  bool window_done = lockin_accumulate(&beam_ptr->lockin, v);
+  digitalWrite(LASER_PIN, beam_ptr->lockin.laser_on);
+
+  if (window_done) {
+    update_beam_state(
+        beam_ptr->lockin.value > (long)beam_ptr->lockin_threshold, t);
+  }
+}
+
 void IRAM_ATTR ISR_ir_pulse_train_gen() {
   portENTER_CRITICAL_ISR(&ir_pulse_train_spinlock);
   if ((micros() % IR_PULSE_PERIOD_US) <= IR_PULSE_HIGH_TIME_US) {
@@ -179,6 +240,8 @@ detection_mode_t str_to_detection_mode(const char *str) {
     return LASER_PHOTOTRANS_DIG;
   } else if (!strcmp(str, "LASER_PHOTOTRANS_ADC")) {
     return LASER_PHOTOTRANS_ADC;
+  } else if (!strcmp(str, "LASER_PHOTOTRANS_LOCKIN")) {
+    return LASER_PHOTOTRANS_LOCKIN;
   }
   return INVALID;
 }
@@ -204,6 +267,8 @@ const char *detection_mode_to_str(detection_mode_t mode) {
       return "LASER_PHOTOTRANS_DIG";
     case LASER_PHOTOTRANS_ADC:
       return "LASER_PHOTOTRANS_ADC";
+    case LASER_PHOTOTRANS_LOCKIN:
+      return "LASER_PHOTOTRANS_LOCKIN";
     default:
       return "INVALID";
   }
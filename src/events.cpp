@@ -0,0 +1,88 @@
+#include "events.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "web.h"
+
+static event_t ring[EVENT_RING_SIZE];
+static volatile unsigned long head = 0;  // seq of the newest event, 0 if none
+static unsigned long epoch = 0;  // changes every boot so clients drop old seqs
+static portMUX_TYPE events_spinlock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t events_mutex = NULL;
+static event_t scratch[EVENT_RING_SIZE];
+static StaticJsonDocument<EVENT_DOC_SIZE> events_doc;
+
+void init_events() {
+  epoch = esp_random();
+  events_mutex = xSemaphoreCreateMutex();
+  LOGF("Event ring initialized, epoch %lu\n", epoch);
+}
+
+void IRAM_ATTR push_event(event_type_t type, unsigned long time,
+                          unsigned int counter, unsigned long duration) {
+  portENTER_CRITICAL_ISR(&events_spinlock);
+  event_t &e = ring[++head % EVENT_RING_SIZE];
+  e.seq = head;
+  e.type = type;
+  e.time = time;
+  e.counter = counter;
+  e.duration = duration;
+  portEXIT_CRITICAL_ISR(&events_spinlock);
+}
+
+unsigned long events_head() { return head; }
+
+unsigned long events_epoch() { return epoch; }
+
+// Serializes every event newer than `after`. If some of them have already
+// been overwritten the message is marked truncated, and the client should fall
+// back to the state and leaderboard snapshots. `replay` marks the answer to a
+// client's replay request, as opposed to a broadcast batch.
+AsyncWebSocketSharedBuffer events_snapshot(unsigned long after, bool replay) {
+  xSemaphoreTake(events_mutex, portMAX_DELAY);
+  portENTER_CRITICAL(&events_spinlock);
+  unsigned long last = head;
+  unsigned long oldest =
+      last > EVENT_RING_SIZE ? last - EVENT_RING_SIZE + 1 : 1;
+  bool truncated = after + 1 < oldest;
+  if (after > last) after = last;
+  if (truncated) after = oldest - 1;
+  size_t n = last - after;
+  for (size_t i = 0; i < n; ++i) {
+    scratch[i] = ring[(after + 1 + i) % EVENT_RING_SIZE];
+  }
+  portEXIT_CRITICAL(&events_spinlock);
+
+  events_doc.clear();
+  events_doc["msg"] = "events";
+  events_doc["epoch"] = epoch;
+  events_doc["head"] = last;
+  events_doc["truncated"] = truncated;
+  events_doc["replay"] = replay;
+  JsonArray events = events_doc.createNestedArray("events");
+  for (size_t i = 0; i < n; ++i) {
+    JsonObject e = events.createNestedObject();
+    e["seq"] = scratch[i].seq;
+    e["type"] = event_type_to_str(scratch[i].type);
+    e["time"] = scratch[i].time;
+    e["counter"] = scratch[i].counter;
+    if (scratch[i].type == EVENT_FINISH) e["duration"] = scratch[i].duration;
+  }
+
+  AsyncWebSocketSharedBuffer buffer = ws_serialize(events_doc);
+  xSemaphoreGive(events_mutex);
+  return buffer;
+}
+
+const char *event_type_to_str(event_type_t type) {
+  switch (type) {
+    case EVENT_START:
+      return "start";
+    case EVENT_CROSSING:
+      return "crossing";
+    case EVENT_FINISH:
+      return "finish";
+    default:
+      return "invalid";
+  }
+}
@@ -3,30 +3,40 @@
 
 #include "beam.h"
 #include "debug.h"
+#include "events.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "md_max.h"
 #include "pins.h"
+#include "power.h"
+#include "session.h"
 #include "web.h"
 
 #define TOUCH_STRIP_TIMEOUT_US 250000
 #define APP_TASK_CORE 1
 #define APP_TASK_PRI 1
+#define WS_CLEANUP_INTERVAL_MS 1000
 
 #define DEFAULT_MODE LASER_PHOTOTRANS_ADC
 #define DEFAULT_INTENSITY 4
 #define DEFAULT_WHEEL_CROSSINGS 3
 #define DEFAULT_ADC_THRESHOLD 512
+#define DEFAULT_LOCKIN_THRESHOLD 128
 #define DEFAULT_BEAM_CROSS_LOCKOUT_MS 0
 
-void ws_command_handler(StaticJsonDocument<512> doc);
+void ws_command_handler(AsyncWebSocketClient *client,
+                        StaticJsonDocument<512> doc);
 void update_clients(const char *msg = NULL);
+void update_leaderboard();
+void publish_events();
 void IRAM_ATTR ISR_touch_strip();
 void app_task(void *pvParameters);
 void handle_touch();
 
 static beam_t beam;
+static power_t power;
 static TaskHandle_t app_task_handle = NULL;
+static volatile bool app_task_stop = false;
 static uint8_t intensity = 0;
 static Preferences prefs;
 static MD_Parola md_max =
@@ -35,8 +45,10 @@ static DNSServer dns_server;
 static AsyncWebServer server(HTTP_PORT);
 static AsyncWebSocket socket(WEBSOCKET_NAME);
 static StaticJsonDocument<1024> txdoc;
-static char txbuf[1024];
 static volatile bool touch_strip_touched = false;
+static unsigned long ready_ms = 0;
+static unsigned long published_seq = 0;
+static unsigned long cleanup_ms = 0;
 
 void init_pins() {
   pinMode(STATUS_LED_PIN, OUTPUT);
@@ -61,11 +73,12 @@ void init_prefs() {
 
   beam.crossings = prefs.getUInt("crossings", DEFAULT_WHEEL_CROSSINGS);
   beam.adc_threshold = prefs.getUInt("adc_threshold", DEFAULT_ADC_THRESHOLD);
+  beam.lockin_threshold =
+      prefs.getUInt("lockin_threshold", DEFAULT_LOCKIN_THRESHOLD);
   beam.beam_cross_lockout_ms =
       prefs.getUInt("beam_cross_lockout_ms", DEFAULT_BEAM_CROSS_LOCKOUT_MS);
   set_display_intensity(intensity);
 }
-}
 
 void setup() {
 #if DEBUG == 1
@@ -73,32 +86,53 @@ void setup() {
   LOGF("Serial debugging enabled\n");
 #endif
 
-  init_fs();
-  init_wifi(&dns_server);
-  init_webserver(&server, &socket, ws_command_handler);
+  init_session();
+  init_events();
   init_display(&md_max);
   init_pins();
   init_prefs();
+  init_power(&power, &beam);
+  init_network(&dns_server, &server, &socket, ws_command_handler);
 }
 
 void app_task(void *pvParameters) {
+  if (!ready_ms) {
+    ready_ms = millis();
+    LOGF("Ready %lu ms after boot\n", ready_ms);
+  }
   display_print("Ready");
   update_clients("Ready");
 
-  while (true) {
+  // Stops only between updates, never while holding a session, events or
+  // WebSocket mutex; see ws_command_handler().
+  while (!app_task_stop) {
     reset_beam();
-    while (!beam.counter) {
+    power_activity();
+    while (!beam.counter && !app_task_stop) {
       update_clients("Ready");
-      vTaskDelay(100);
+      // Woken early by the beam ISR when a start interrupts idle polling, or
+      // by a mode change.
+      if (ulTaskNotifyTake(pdTRUE, power.idle ? POWER_IDLE_UPDATE_MS : 100)) {
+        power_exit_idle();
+      }
+      power_update();
     }
-    while (!beam.finish_time) {
+    power_exit_idle();
+    while (!beam.finish_time && !app_task_stop) {
       update_clients("Running");
       display_time(beam.start_time, micros());
       vTaskDelay(100);
     }
+    if (app_task_stop) break;
     display_time(beam.start_time, beam.finish_time);
+    session_record_run(beam.finish_time - beam.start_time);
     update_clients("Finish");
+    update_leaderboard();
   }
+
+  app_task_stop = false;
+  app_task_handle = NULL;
+  vTaskDelete(NULL);
 }
 
 bool check_beam_stability() {
@@ -118,9 +152,14 @@ bool check_beam_stability() {
 }
 
 void loop() {
-  ArduinoOTA.handle();
+  if (millis() - cleanup_ms > WS_CLEANUP_INTERVAL_MS) {
+    // The library default would close clients beyond 8.
+    socket.cleanupClients(WS_MAX_CLIENTS);
+    cleanup_ms = millis();
+  }
   handle_touch();
   if (!app_task_handle) {
+    power_exit_idle();
     if (check_beam_stability()) {
       display_print("Locked");
       delay(1000);
@@ -129,6 +168,10 @@ void loop() {
     } else {
       display_print("No lock");
     }
+  } else {
+    // Yield core 1 so the idle task runs and a woken app_task is not kept
+    // waiting for a time slice.
+    delay(10);
   }
 }
 
@@ -138,50 +181,92 @@ void update_clients(const char *msg) {
     for (int i = 0; i < strlen(msg); ++i) msg_l[i] = tolower(msg[i]);
   }
 
-  if (socket.availableForWriteAll()) {
-    txdoc["msg"] = msg ? msg_l : "";
-    txdoc["mode"] = detection_mode_to_str(beam.mode);
-    txdoc["state"] = beam.state == RECEIVED      ? "RECEIVED"
-                     : beam.state == INTERRUPTED ? "INTERRUPTED"
-                                                 : "NOT_ESTABLISHED";
-    txdoc["counter"] = beam.counter;
-    txdoc["start"] = beam.start_time;
-    txdoc["finish"] = beam.finish_time;
-    txdoc["change"] = beam.change_time;
-    txdoc["crossings"] = beam.crossings;
-    txdoc["beam_cross_lockout_ms"] = beam.beam_cross_lockout_ms;
-    txdoc["time"] = micros();
-    txdoc["adc_value"] = beam.adc_value;
-    txdoc["adc_threshold"] = beam.adc_threshold;
-    txdoc["adc_sample_time"] = beam.adc_sample_time;
-    txdoc["samples"] = beam.samples;
-    txdoc["sample_rate"] = beam.sample_rate;
-    txdoc["intensity"] = intensity;
-    txdoc["touchread"] = touchRead(TOUCH_STRIP_PIN);
-    txdoc["free_heap"] = ESP.getFreeHeap();
-    txdoc["txdoc_size"] = 1024;
-    txdoc["txdoc_size"] = txdoc.memoryUsage();
-
-    serializeJson(txdoc, txbuf);
-    socket.textAll(txbuf);
+  publish_events();
+  if (!socket.count()) return;
+
+  txdoc["msg"] = msg ? msg_l : "";
+  txdoc["mode"] = detection_mode_to_str(beam.mode);
+  txdoc["state"] = beam.state == RECEIVED      ? "RECEIVED"
+                   : beam.state == INTERRUPTED ? "INTERRUPTED"
+                                               : "NOT_ESTABLISHED";
+  txdoc["counter"] = beam.counter;
+  txdoc["start"] = beam.start_time;
+  txdoc["finish"] = beam.finish_time;
+  txdoc["change"] = beam.change_time;
+  txdoc["crossings"] = beam.crossings;
+  txdoc["beam_cross_lockout_ms"] = beam.beam_cross_lockout_ms;
+  txdoc["time"] = micros();
+  txdoc["adc_value"] = beam.adc_value;
+  txdoc["adc_threshold"] = beam.adc_threshold;
+  txdoc["adc_sample_time"] = beam.adc_sample_time;
+  txdoc["lockin_value"] = beam.lockin.value;
+  txdoc["lockin_threshold"] = beam.lockin_threshold;
+  txdoc["samples"] = beam.samples;
+  txdoc["sample_rate"] = beam.sample_rate;
+  txdoc["intensity"] = intensity;
+  txdoc["rider"] = get_session_rider();
+  txdoc["event_seq"] = published_seq;
+  txdoc["touchread"] = touchRead(TOUCH_STRIP_PIN);
+  txdoc["free_heap"] = ESP.getFreeHeap();
+  txdoc["ready_ms"] = ready_ms;
+  txdoc["network_ready_ms"] = network_ready_time();
+  txdoc["power_idle"] = power.idle;
+  txdoc["power_enter_idle_us"] = power.enter_idle_us;
+  txdoc["power_exit_idle_us"] = power.exit_idle_us;
+  txdoc["power_max_wake_latency_us"] = power.max_wake_latency_us;
+  txdoc["power_worst_start_latency_us"] = power.worst_start_latency_us;
+  txdoc["power_min_interruption_us"] = power.min_interruption_us;
+  // From the nominal POWER_*_MA figures, not a measurement.
+  txdoc["battery_nominal_est_h"] = power_battery_hours();
+  txdoc["txdoc_size"] = 1024;
+  txdoc["txdoc_size"] = txdoc.memoryUsage();
+
+  txdoc["ws_clients"] = socket.count();
+  txdoc["ws_throttled"] = ws_throttled_clients();
+
+  // Only the finish carries a result; other updates are superseded by the
+  // next one, so slow clients may skip them.
+  ws_broadcast(&socket, ws_serialize(txdoc), msg && !strcmp(msg, "Finish"));
+}
+
+// The leaderboard is only sent when it changes or a client asks for it, so
+// spectators never have to rebuild it from the run history.
+void update_leaderboard() { ws_broadcast(&socket, session_snapshot(), true); }
+
+// Broadcasts events newer than the last batch. A client that misses a batch
+// sees a gap in seq and asks for a replay instead of a full-state dump.
+void publish_events() {
+  unsigned long head = events_head();
+  if (head == published_seq) return;
+  if (socket.count()) {
+    ws_broadcast(&socket, events_snapshot(published_seq), true);
   }
+  published_seq = head;
 }
 
 void IRAM_ATTR ISR_touch_strip() { touch_strip_touched = true; }
 
-void ws_command_handler(StaticJsonDocument<512> doc) {
+void ws_command_handler(AsyncWebSocketClient *client,
+                        StaticJsonDocument<512> doc) {
   for (JsonPair kv : doc.as<JsonObject>()) {
     if (kv.key() == "mode") {
       beam.mode = str_to_detection_mode(kv.value().as<const char *>());
       prefs.putUInt("mode", static_cast<int>(beam.mode));
-      if (app_task_handle) {
-        vTaskDelete(app_task_handle);
-        app_task_handle = NULL;
+      // app_task may hold a mutex right now, so it deletes itself at a safe
+      // point and loop() restarts it once app_task_handle is cleared. It is
+      // notified before the flag is set, while it cannot yet have exited.
+      if (TaskHandle_t task = app_task_handle) {
+        xTaskNotifyGive(task);
+        app_task_stop = true;
       }
     } else if (kv.key() == "adc_threshold") {
       beam.adc_threshold = kv.value().as<int>();
       prefs.putUInt("adc_threshold", beam.adc_threshold);
       LOGF("ADC threshold updated to %d\n", kv.value().as<int>())
+    } else if (kv.key() == "lockin_threshold") {
+      beam.lockin_threshold = kv.value().as<int>();
+      prefs.putUInt("lockin_threshold", beam.lockin_threshold);
+      LOGF("Lock-in threshold updated to %d\n", beam.lockin_threshold);
     } else if (kv.key() == "crossings") {
       beam.crossings = kv.value().as<int>();
       prefs.putUInt("crossings", beam.crossings);
@@ -195,6 +280,21 @@ void ws_command_handler(StaticJsonDocument<512> doc) {
       beam.beam_cross_lockout_ms = kv.value().as<int>();
       prefs.putUInt("beam_cross_lockout_us", beam.beam_cross_lockout_ms);
       LOGF("Beam cross lockout updated to %d\n", beam.beam_cross_lockout_ms);
+    } else if (kv.key() == "rider") {
+      set_session_rider(kv.value().as<int>());
+      LOGF("Rider updated to %d\n", get_session_rider());
+    } else if (kv.key() == "reset_session") {
+      reset_session();
+      update_leaderboard();
+    } else if (kv.key() == "leaderboard") {
+      // Asked for by each client on connect; nobody else needs a copy.
+      client->text(session_snapshot());
+    } else if (kv.key() == "replay") {
+      // Sequence numbers restart on reboot; replay everything then.
+      unsigned long after = kv.value().as<unsigned long>();
+      if (doc["epoch"].as<unsigned long>() != events_epoch()) after = 0;
+      client->text(events_snapshot(after, true));
+      LOGF("Replayed events after %lu to client %u\n", after, client->id());
     }
   }
 }
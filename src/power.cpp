@@ -0,0 +1,111 @@
+#include "power.h"
+
+#include <esp_wifi.h>
+
+static power_t *power_ptr = NULL;
+static beam_t *beam_ptr = NULL;
+
+static void account_state_time() {
+  unsigned long now = millis();
+  if (power_ptr->idle) {
+    power_ptr->idle_ms += now - power_ptr->state_since_ms;
+  } else {
+    power_ptr->active_ms += now - power_ptr->state_since_ms;
+  }
+  power_ptr->state_since_ms = now;
+}
+
+// A start is timestamped at the first sample that sees the interruption, so
+// it can be late by up to one sample interval. A sampled mode only reliably
+// sees an interruption that lasts at least that interval; a shorter one can
+// fall between two samples and is missed. The lock-in window is fixed and an
+// interruption must cover a whole window, which can start up to one window
+// after the interruption does.
+static void update_detection_bounds() {
+  if (beam_ptr->mode == LASER_PHOTOTRANS_LOCKIN) {
+    unsigned long window = 2 * LOCKIN_WINDOW_PERIODS * LOCKIN_HALF_PERIOD_US;
+    power_ptr->worst_start_latency_us = window;
+    power_ptr->min_interruption_us = 2 * window;
+  } else {
+    unsigned long interval =
+        beam_poll_interval(beam_ptr->mode, power_ptr->idle);
+    power_ptr->worst_start_latency_us = interval;
+    power_ptr->min_interruption_us = interval;
+  }
+}
+
+void init_power(power_t *power, beam_t *beam) {
+  power_ptr = power;
+  beam_ptr = beam;
+  power_ptr->last_activity_ms = power_ptr->state_since_ms = millis();
+  update_detection_bounds();
+  LOGF("Power management initialized, idle after %d ms\n",
+       POWER_IDLE_TIMEOUT_MS);
+}
+
+// Also called by app_task at the start of every run, which picks up a mode
+// change.
+void power_activity() {
+  power_ptr->last_activity_ms = millis();
+  update_detection_bounds();
+}
+
+void power_update() {
+  if (!power_ptr->idle &&
+      millis() - power_ptr->last_activity_ms > POWER_IDLE_TIMEOUT_MS) {
+    power_enter_idle();
+  }
+}
+
+void power_enter_idle() {
+  if (power_ptr->idle) return;
+  unsigned long t = micros();
+  account_state_time();
+
+  beam_ptr->wake_task = xTaskGetCurrentTaskHandle();
+  set_beam_idle(true);
+  setCpuFrequencyMhz(POWER_IDLE_CPU_MHZ);
+  esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+  power_ptr->idle = true;
+  update_detection_bounds();
+
+  power_ptr->enter_idle_us = micros() - t;
+  LOGF("Entered idle in %lu us, worst-case start latency %lu us, shortest "
+       "detected interruption %lu us\n",
+       power_ptr->enter_idle_us, power_ptr->worst_start_latency_us,
+       power_ptr->min_interruption_us);
+}
+
+void power_exit_idle() {
+  if (!power_ptr->idle) return;
+  unsigned long t = micros();
+  account_state_time();
+
+  setCpuFrequencyMhz(POWER_ACTIVE_CPU_MHZ);
+  set_beam_idle(false);
+  esp_wifi_set_ps(WIFI_PS_NONE);
+  power_ptr->idle = false;
+  power_activity();  // also resets the detection bounds to the active rate
+
+  unsigned long done = micros();
+  power_ptr->exit_idle_us = done - t;
+  if (beam_ptr->wake_time) {
+    power_ptr->wake_latency_us = done - beam_ptr->wake_time;
+    power_ptr->max_wake_latency_us =
+        max(power_ptr->max_wake_latency_us, power_ptr->wake_latency_us);
+    beam_ptr->wake_time = 0;
+  }
+  LOGF("Exited idle in %lu us, %lu us after the beam was interrupted\n",
+       power_ptr->exit_idle_us, power_ptr->wake_latency_us);
+}
+
+float power_battery_hours() {
+  unsigned long current = millis() - power_ptr->state_since_ms;
+  float idle = power_ptr->idle_ms + (power_ptr->idle ? current : 0);
+  float total = power_ptr->active_ms + power_ptr->idle_ms + current;
+  if (!total) return 0;
+  float idle_fraction = idle / total;
+  float ma = POWER_ACTIVE_MA * (1 - idle_fraction) +
+             POWER_IDLE_MA * idle_fraction;
+  return POWER_BATTERY_MAH / ma;
+}
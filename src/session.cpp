@@ -0,0 +1,280 @@
+#include "session.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "web.h"
+
+struct rider_stats_t {
+  unsigned int id = 0;
+  unsigned int runs = 0;
+  unsigned long best = 0;
+  unsigned long long total = 0;
+};
+
+struct last_run_t {
+  unsigned int rider = 0;
+  unsigned long time = 0;
+  unsigned int rank = 0;  // rank of the rider's best after this run, 1-based
+  unsigned long gap = 0;  // this run minus the session best
+  bool personal_best = false;
+};
+
+// Size-augmented treap over a fixed node pool, ordered by (key, tag). Gives
+// O(log n) expected insert, erase, rank and k-th lookups without touching the
+// heap, so a finish never re-sorts the session.
+template <size_t N>
+class rank_tree_t {
+ public:
+  void clear() {
+    root = 0;
+    nodes[0] = node_t();
+  }
+
+  size_t size() const { return nodes[root].size; }
+  unsigned long key(uint16_t n) const { return nodes[n].key; }
+  uint16_t tag(uint16_t n) const { return nodes[n].tag; }
+
+  // Slot n (1..N) is owned by the caller so erased slots can be reused.
+  void insert(uint16_t n, unsigned long key, uint16_t tag) {
+    nodes[n].key = key;
+    nodes[n].tag = tag;
+    nodes[n].prio = next_prio();
+    nodes[n].left = nodes[n].right = 0;
+    nodes[n].size = 1;
+    uint16_t l, r;
+    split(root, key, tag, l, r);
+    root = merge(merge(l, n), r);
+  }
+
+  void erase(unsigned long key, uint16_t tag) { root = erase(root, key, tag); }
+
+  // Number of entries ordered strictly before (key, tag).
+  size_t rank(unsigned long key, uint16_t tag) const {
+    size_t rank = 0;
+    uint16_t t = root;
+    while (t) {
+      if (less(nodes[t].key, nodes[t].tag, key, tag)) {
+        rank += nodes[nodes[t].left].size + 1;
+        t = nodes[t].right;
+      } else {
+        t = nodes[t].left;
+      }
+    }
+    return rank;
+  }
+
+  // Slot holding the k-th smallest entry, 0-based. Returns 0 if out of range.
+  uint16_t kth(size_t k) const {
+    uint16_t t = root;
+    while (t) {
+      size_t left = nodes[nodes[t].left].size;
+      if (k < left) {
+        t = nodes[t].left;
+      } else if (k == left) {
+        return t;
+      } else {
+        k -= left + 1;
+        t = nodes[t].right;
+      }
+    }
+    return 0;
+  }
+
+ private:
+  struct node_t {
+    unsigned long key = 0;
+    uint32_t prio = 0;
+    uint16_t tag = 0;
+    uint16_t left = 0;
+    uint16_t right = 0;
+    uint16_t size = 0;
+  };
+
+  node_t nodes[N + 1];  // slot 0 is the empty sentinel
+  uint16_t root = 0;
+  uint32_t seed = 2463534242;
+
+  static bool less(unsigned long ka, uint16_t ta, unsigned long kb,
+                   uint16_t tb) {
+    return ka < kb || (ka == kb && ta < tb);
+  }
+
+  uint32_t next_prio() {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+  }
+
+  void pull(uint16_t t) {
+    nodes[t].size = nodes[nodes[t].left].size + nodes[nodes[t].right].size + 1;
+  }
+
+  void split(uint16_t t, unsigned long key, uint16_t tag, uint16_t &l,
+             uint16_t &r) {
+    if (!t) {
+      l = r = 0;
+    } else if (less(nodes[t].key, nodes[t].tag, key, tag)) {
+      split(nodes[t].right, key, tag, nodes[t].right, r);
+      l = t;
+      pull(t);
+    } else {
+      split(nodes[t].left, key, tag, l, nodes[t].left);
+      r = t;
+      pull(t);
+    }
+  }
+
+  uint16_t merge(uint16_t l, uint16_t r) {
+    if (!l || !r) return l ? l : r;
+    if (nodes[l].prio > nodes[r].prio) {
+      nodes[l].right = merge(nodes[l].right, r);
+      pull(l);
+      return l;
+    }
+    nodes[r].left = merge(l, nodes[r].left);
+    pull(r);
+    return r;
+  }
+
+  uint16_t erase(uint16_t t, unsigned long key, uint16_t tag) {
+    if (!t) return 0;
+    if (nodes[t].key == key && nodes[t].tag == tag) {
+      return merge(nodes[t].left, nodes[t].right);
+    }
+    if (less(key, tag, nodes[t].key, nodes[t].tag)) {
+      nodes[t].left = erase(nodes[t].left, key, tag);
+    } else {
+      nodes[t].right = erase(nodes[t].right, key, tag);
+    }
+    pull(t);
+    return t;
+  }
+};
+
+static rank_tree_t<SESSION_MAX_RUNS> runs;     // every run, by duration
+static rank_tree_t<SESSION_MAX_RIDERS> bests;  // personal bests, by duration
+static rider_stats_t riders[SESSION_MAX_RIDERS];
+static unsigned int rider_count = 0;
+static unsigned int run_count = 0;     // runs in the percentile pool
+static unsigned int finish_count = 0;  // every run, pooled or not
+static unsigned int current_rider = 0;
+static last_run_t last_run;
+static unsigned long version = 0;
+static SemaphoreHandle_t session_mutex = NULL;
+static StaticJsonDocument<SESSION_SNAPSHOT_DOC_SIZE> snapshot_doc;
+
+static int find_rider(unsigned int id) {
+  for (unsigned int i = 0; i < rider_count; ++i) {
+    if (riders[i].id == id) return i;
+  }
+  if (rider_count == SESSION_MAX_RIDERS) return -1;
+  riders[rider_count] = rider_stats_t();
+  riders[rider_count].id = id;
+  return rider_count++;
+}
+
+static unsigned long percentile(unsigned int p) {
+  size_t n = runs.size();
+  if (!n) return 0;
+  return runs.key(runs.kth((p * (n - 1) + 50) / 100));
+}
+
+void init_session() {
+  session_mutex = xSemaphoreCreateMutex();
+  reset_session();
+  LOGF("Session initialized\n");
+}
+
+void reset_session() {
+  xSemaphoreTake(session_mutex, portMAX_DELAY);
+  runs.clear();
+  bests.clear();
+  rider_count = 0;
+  run_count = 0;
+  finish_count = 0;
+  last_run = last_run_t();
+  version++;
+  xSemaphoreGive(session_mutex);
+  LOGF("Session reset\n");
+}
+
+void set_session_rider(unsigned int rider) { current_rider = rider; }
+
+unsigned int get_session_rider() { return current_rider; }
+
+// Once the run pool is full, percentiles stop moving but riders, bests and
+// the last run keep updating, so the leaderboard stays live.
+void session_record_run(unsigned long duration) {
+  xSemaphoreTake(session_mutex, portMAX_DELAY);
+  int slot = find_rider(current_rider);
+  if (slot < 0) {
+    xSemaphoreGive(session_mutex);
+    LOGF("Rider limit reached, run of %lu us not recorded\n", duration);
+    return;
+  }
+
+  if (run_count < SESSION_MAX_RUNS) {
+    runs.insert(run_count + 1, duration, run_count);
+    run_count++;
+  }
+  finish_count++;
+
+  rider_stats_t &r = riders[slot];
+  bool personal_best = !r.best || duration < r.best;
+  if (personal_best) {
+    if (r.best) bests.erase(r.best, slot);
+    r.best = duration;
+    bests.insert(slot + 1, duration, slot);
+  }
+  r.runs++;
+  r.total += duration;
+
+  last_run.rider = r.id;
+  last_run.time = duration;
+  last_run.rank = bests.rank(r.best, slot) + 1;
+  last_run.gap = duration - bests.key(bests.kth(0));
+  last_run.personal_best = personal_best;
+  version++;
+  xSemaphoreGive(session_mutex);
+
+  LOGF("Rider %u run %lu us, rank %u, gap %lu us\n", last_run.rider, duration,
+       last_run.rank, last_run.gap);
+}
+
+AsyncWebSocketSharedBuffer session_snapshot() {
+  xSemaphoreTake(session_mutex, portMAX_DELAY);
+  snapshot_doc.clear();
+  snapshot_doc["msg"] = "leaderboard";
+  snapshot_doc["version"] = version;
+  snapshot_doc["runs"] = finish_count;
+  snapshot_doc["full"] = run_count == SESSION_MAX_RUNS;
+  unsigned long leader = bests.size() ? bests.key(bests.kth(0)) : 0;
+  snapshot_doc["best"] = leader;
+  snapshot_doc["median"] = percentile(50);
+  snapshot_doc["p90"] = percentile(90);
+
+  if (finish_count) {
+    JsonObject last = snapshot_doc.createNestedObject("last");
+    last["rider"] = last_run.rider;
+    last["time"] = last_run.time;
+    last["rank"] = last_run.rank;
+    last["gap"] = last_run.gap;
+    last["pb"] = last_run.personal_best;
+  }
+
+  JsonArray board = snapshot_doc.createNestedArray("riders");
+  for (size_t i = 0; i < bests.size() && i < SESSION_LEADERBOARD_SIZE; ++i) {
+    const rider_stats_t &r = riders[bests.tag(bests.kth(i))];
+    JsonObject entry = board.createNestedObject();
+    entry["id"] = r.id;
+    entry["runs"] = r.runs;
+    entry["best"] = r.best;
+    entry["avg"] = (unsigned long)(r.total / r.runs);
+    entry["gap"] = r.best - leader;
+  }
+
+  AsyncWebSocketSharedBuffer buffer = ws_serialize(snapshot_doc);
+  xSemaphoreGive(session_mutex);
+  return buffer;
+}
@@ -26,7 +26,20 @@ static const std::list<std::tuple<const char *, const char *, const char *>>
         {"/site.webmanifest", "/site.webmanifest", "text/plain"},
 };
 
-static void (*ws_data_callback)(StaticJsonDocument<512> doc) = NULL;
+struct ws_client_t {
+  uint32_t id = 0;  // 0 marks a free slot
+  ws_throttle_t<AsyncWebSocketSharedBuffer> throttle;
+};
+
+static void (*ws_data_callback)(AsyncWebSocketClient *client,
+                                StaticJsonDocument<512> doc) = NULL;
+static ws_client_t ws_clients[WS_MAX_CLIENTS];
+static SemaphoreHandle_t ws_clients_mutex = NULL;
+static DNSServer *dns_server_ptr = NULL;
+static AsyncWebServer *server_ptr = NULL;
+static AsyncWebSocket *socket_ptr = NULL;
+static bool soft_ap = false;
+static volatile unsigned long network_ready_ms = 0;
 static StaticJsonDocument<512> rxdoc;
 static char ws_data_buf[512];
 
@@ -38,37 +51,85 @@ void init_fs() {
   }
 }
 
-void init_wifi(DNSServer *dns_server) {
-  esp_wifi_set_ps(WIFI_PS_NONE);
-
-#if WIFI_SOFT_AP == 1
+static void init_soft_ap(DNSServer *dns_server) {
   LOGF("Configuring WiFi Soft AP\n");
   WiFi.mode(WIFI_AP);
   WiFi.softAP(WIFI_SOFT_AP_SSID);
   LOGF("WiFi AP SSID: %s\nSoft AP IP: %s\n", WIFI_SOFT_AP_SSID,
-       WiFi.softAPIP());
+       WiFi.softAPIP().toString().c_str());
 
   dns_server->start(53, "*", WiFi.softAPIP());
+  soft_ap = true;
   LOGF("Captive portal DNS server started\n");
+}
+
+void init_wifi(DNSServer *dns_server) {
+#if WIFI_SOFT_AP == 1
+  init_soft_ap(dns_server);
 #else
   LOGF("Connecting to %s\n", WIFI_STA_SSID);
   WiFi.mode(WIFI_STA);
   WiFi.begin(WIFI_STA_SSID, WIFI_STA_PSK);
-  while (WiFi.status() != WL_CONNECTED) {
+  unsigned long t = millis();
+  while (WiFi.status() != WL_CONNECTED &&
+         millis() - t < WIFI_STA_TIMEOUT_MS) {
     LOGF(".");
     delay(100);
   }
-  LOGF("\nLocal IP: %s\n", WiFi.localIP().toString());
-  LOGF("OTA updater started\n");
+  if (WiFi.status() == WL_CONNECTED) {
+    LOGF("\nLocal IP: %s\n", WiFi.localIP().toString().c_str());
+  } else {
+    LOGF("\nNo connection to %s, falling back to soft AP\n", WIFI_STA_SSID);
+    WiFi.disconnect(true);
+    init_soft_ap(dns_server);
+  }
 #endif
+  // Only takes effect once WiFi is started; power.cpp switches to modem sleep
+  // in idle and back.
+  esp_wifi_set_ps(WIFI_PS_NONE);
 
   ArduinoOTA.begin();
   LOGF("OTA server started\n");
   MDNS.begin(MDNS_NAME);
   LOGF("mDNS responder started: http://%s.local\n", MDNS_NAME);
 }
+
+// Brings up the filesystem, WiFi and webserver off the main task, so that
+// the display and beam are timing while the network is still connecting, then
+// stays to service OTA and the captive portal DNS.
+static void network_task(void *pvParameters) {
+  unsigned long t = millis();
+  init_fs();
+  init_wifi(dns_server_ptr);
+  init_webserver(server_ptr, socket_ptr, ws_data_callback);
+  network_ready_ms = millis();
+  LOGF("Network ready in %lu ms (%lu ms after boot)\n", network_ready_ms - t,
+       network_ready_ms);
+
+  while (true) {
+    ArduinoOTA.handle();
+    if (soft_ap) dns_server_ptr->processNextRequest();
+    vTaskDelay(NETWORK_TASK_POLL_MS);
+  }
+}
+
+void init_network(DNSServer *dns_server, AsyncWebServer *server,
+                  AsyncWebSocket *socket,
+                  void (*cb)(AsyncWebSocketClient *client,
+                             StaticJsonDocument<512> doc)) {
+  dns_server_ptr = dns_server;
+  server_ptr = server;
+  socket_ptr = socket;
+  ws_data_callback = cb;
+  xTaskCreatePinnedToCore(network_task, "network_task", NETWORK_TASK_STACK,
+                          NULL, NETWORK_TASK_PRI, NULL, NETWORK_TASK_CORE);
+}
+
+unsigned long network_ready_time() { return network_ready_ms; }
+
 void init_webserver(AsyncWebServer *server, AsyncWebSocket *socket,
-                    void (*cb)(StaticJsonDocument<512> rxdoc)) {
+                    void (*cb)(AsyncWebSocketClient *client,
+                               StaticJsonDocument<512> rxdoc)) {
   for (auto const &it : assets) {
     server->on(std::get<0>(it), HTTP_GET, [it](AsyncWebServerRequest *req) {
       AsyncWebServerResponse *resp =
@@ -83,12 +144,86 @@ void init_webserver(AsyncWebServer *server, AsyncWebSocket *socket,
   }
 
   ws_data_callback = cb;
+  ws_clients_mutex = xSemaphoreCreateMutex();
   socket->onEvent(ws_event_handler);
   server->addHandler(socket);
   LOGF("Starting webserver\n");
   server->begin();
 }
 
+static ws_client_t *find_ws_client(uint32_t id) {
+  for (ws_client_t &c : ws_clients) {
+    if (c.id == id) return &c;
+  }
+  return NULL;
+}
+
+AsyncWebSocketSharedBuffer ws_serialize(JsonDocument &doc) {
+  size_t len = measureJson(doc);
+  auto buffer = std::make_shared<std::vector<uint8_t>>(len + 1);
+  serializeJson(doc, (char *)buffer->data(), len + 1);
+  buffer->resize(len);
+  return buffer;
+}
+
+// The payload is serialized once by the caller; every client queue holds a
+// reference to the same buffer rather than its own copy. Clients are resolved
+// by id and the pointer is only used until the next blocking call: the
+// AsyncTCP task may free a disconnecting client at any time in between.
+void ws_broadcast(AsyncWebSocket *socket, AsyncWebSocketSharedBuffer buffer,
+                  bool essential) {
+  if (!ws_clients_mutex) return;
+  uint32_t ids[WS_MAX_CLIENTS];
+  size_t count = 0;
+  xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+  for (const ws_client_t &c : ws_clients) {
+    if (c.id) ids[count++] = c.id;
+  }
+  xSemaphoreGive(ws_clients_mutex);
+
+  AsyncWebSocketSharedBuffer out[WS_CLIENT_PENDING_MAX + 1];
+  for (size_t i = 0; i < count; ++i) {
+    AsyncWebSocketClient *client = socket->client(ids[i]);
+    if (!client || client->status() != WS_CONNECTED) continue;
+    size_t depth = client->queueLen();
+
+    size_t n = 0;
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    if (ws_client_t *c = find_ws_client(ids[i])) {
+      uint8_t divisor = c->throttle.divisor;
+      unsigned long dropped = c->throttle.dropped;
+      n = ws_throttle_update(&c->throttle, depth, buffer, essential, out);
+      if (c->throttle.divisor > divisor) {
+        LOGF("WebSocket client %u congested, 1 in %u updates\n", c->id,
+             c->throttle.divisor);
+      }
+      if (c->throttle.dropped > dropped) {
+        LOGF("WebSocket client %u dropped an essential message\n", c->id);
+      }
+    }
+    xSemaphoreGive(ws_clients_mutex);
+    if (!n) continue;
+
+    // Looked up again: the client may have gone while we waited on the mutex.
+    client = socket->client(ids[i]);
+    for (size_t j = 0; j < n; ++j) {
+      if (client && client->status() == WS_CONNECTED) client->text(out[j]);
+      out[j].reset();
+    }
+  }
+}
+
+size_t ws_throttled_clients() {
+  size_t n = 0;
+  if (!ws_clients_mutex) return n;
+  xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+  for (const ws_client_t &c : ws_clients) {
+    if (c.id && c.throttle.divisor > 1) n++;
+  }
+  xSemaphoreGive(ws_clients_mutex);
+  return n;
+}
+
 void ws_event_handler(AsyncWebSocket *server, AsyncWebSocketClient *client,
                       AwsEventType type, void *arg, uint8_t *data, size_t len) {
   memset(ws_data_buf, 0, sizeof(ws_data_buf));
@@ -96,10 +231,22 @@ void ws_event_handler(AsyncWebSocket *server, AsyncWebSocketClient *client,
     case WS_EVT_CONNECT:
       LOGF("WebSocket client %s:%u connected from %s\n", server->url(),
            client->id(), client->remoteIP().toString().c_str());
+      xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+      if (ws_client_t *c = find_ws_client(0)) {
+        *c = ws_client_t();
+        c->id = client->id();
+      } else {
+        LOGF("WebSocket client limit reached, closing %u\n", client->id());
+        client->close();
+      }
+      xSemaphoreGive(ws_clients_mutex);
       break;
     case WS_EVT_DISCONNECT:
       LOGF("WebSocket client %s:%u disconnected\n", server->url(),
            client->id());
+      xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+      if (ws_client_t *c = find_ws_client(client->id())) *c = ws_client_t();
+      xSemaphoreGive(ws_clients_mutex);
       break;
     case WS_EVT_DATA: {
       AwsFrameInfo *info = (AwsFrameInfo *)arg;
@@ -116,7 +263,7 @@ void ws_event_handler(AsyncWebSocket *server, AsyncWebSocketClient *client,
           LOGF("Websocket client %s:%u data: %s\n", server->url(), client->id(),
                ws_data_buf);
           deserializeJson(rxdoc, ws_data_buf);
-          ws_data_callback(rxdoc);
+          ws_data_callback(client, rxdoc);
         }
         break;
       }
@@ -0,0 +1,79 @@
+#include <unity.h>
+
+#include "lockin.h"
+
+#define ADC_MAX 4095
+#define BEAM_AMPLITUDE 600
+#define LOCKIN_THRESHOLD 128
+
+static unsigned int noise_seed = 1;
+
+// Deterministic +/-20 count noise, roughly what the ADC shows on a still beam.
+static int noise() {
+  noise_seed = noise_seed * 1103515245 + 12345;
+  return (int)((noise_seed >> 16) % 41) - 20;
+}
+
+// Runs one full window against a phototransistor that sees `ambient` counts
+// plus `beam` counts whenever the laser is on, clipped like the real ADC.
+static long run_window(lockin_t *lockin, int ambient, int beam) {
+  for (int i = 0; i < 2 * LOCKIN_WINDOW_PERIODS; ++i) {
+    int v = ambient + (lockin->laser_on ? beam : 0) + noise();
+    if (v < 0) v = 0;
+    if (v > ADC_MAX) v = ADC_MAX;
+    bool done = lockin_accumulate(lockin, v);
+    TEST_ASSERT_EQUAL(i == 2 * LOCKIN_WINDOW_PERIODS - 1, done);
+  }
+  return lockin->value;
+}
+
+void setUp() { noise_seed = 1; }
+
+void tearDown() {}
+
+void test_beam_detected_under_ambient_offsets() {
+  const int ambients[] = {0, 1500, 3000};
+  for (int ambient : ambients) {
+    lockin_t lockin;
+    long value = run_window(&lockin, ambient, BEAM_AMPLITUDE);
+    TEST_ASSERT_INT_WITHIN(40, BEAM_AMPLITUDE, value);
+    TEST_ASSERT_TRUE(value > LOCKIN_THRESHOLD);
+  }
+}
+
+void test_no_beam_rejected_under_ambient_offsets() {
+  const int ambients[] = {0, 1500, 3000};
+  for (int ambient : ambients) {
+    lockin_t lockin;
+    long value = run_window(&lockin, ambient, 0);
+    TEST_ASSERT_INT_WITHIN(40, 0, value);
+    TEST_ASSERT_FALSE(value > LOCKIN_THRESHOLD);
+  }
+}
+
+void test_interruption_detected_within_one_window() {
+  lockin_t lockin;
+  TEST_ASSERT_TRUE(run_window(&lockin, 3000, BEAM_AMPLITUDE) >
+                   LOCKIN_THRESHOLD);
+  TEST_ASSERT_FALSE(run_window(&lockin, 3000, 0) > LOCKIN_THRESHOLD);
+  TEST_ASSERT_TRUE(run_window(&lockin, 3000, BEAM_AMPLITUDE) >
+                   LOCKIN_THRESHOLD);
+}
+
+void test_reset_starts_a_fresh_window() {
+  lockin_t lockin;
+  lockin_accumulate(&lockin, 4000);
+  lockin_accumulate(&lockin, 0);
+  lockin_reset(&lockin);
+  TEST_ASSERT_INT_WITHIN(40, BEAM_AMPLITUDE,
+                         run_window(&lockin, 1500, BEAM_AMPLITUDE));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_beam_detected_under_ambient_offsets);
+  RUN_TEST(test_no_beam_rejected_under_ambient_offsets);
+  RUN_TEST(test_interruption_detected_within_one_window);
+  RUN_TEST(test_reset_starts_a_fresh_window);
+  return UNITY_END();
+}
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <unity.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "ws_throttle.h"
+
+// Load model. Sizes match the firmware's messages. The uplink budget is a
+// conservative figure for what AsyncTCP sustains on an ESP32 in STA mode, and
+// SIM_LIB_QUEUE_MAX is ESPAsyncWebServer's WS_MAX_QUEUED_MESSAGES; beyond it
+// the library discards messages.
+#define SIM_TICK_MS 100  // app_task update period
+#define SIM_STATUS_BYTES 900
+#define SIM_FINISH_BYTES 900
+#define SIM_LEADERBOARD_BYTES 1500
+#define SIM_EVENTS_BYTES 400
+#define SIM_FINISH_EVERY_TICKS 100
+#define SIM_UPLINK_BYTES_PER_S 200000
+#define SIM_LIB_QUEUE_MAX 32
+#define SIM_TICKS 600
+#define SIM_TAIL_TICKS 100
+#define SIM_FAST_CLIENT_BYTES_PER_S 50000
+
+struct sim_msg_t {
+  int seq = 0;  // 0 is the empty buffer
+  bool essential = false;
+  size_t bytes = 0;
+};
+
+struct sim_client_t {
+  ws_throttle_t<sim_msg_t> throttle;
+  std::deque<sim_msg_t> queue;
+  long bytes_per_s = 0;
+  long credit = 0;
+  unsigned long status_received = 0;
+  unsigned long essential_received = 0;
+  unsigned long lost = 0;
+  int last_essential_seq = 0;
+  bool essential_out_of_order = false;
+};
+
+struct sim_result_t {
+  unsigned long status_sent = 0;
+  unsigned long essential_sent = 0;
+};
+
+// Stall windows let a test freeze a client's drain for a span of ticks.
+struct sim_stall_t {
+  size_t client;
+  int from;
+  int to;
+};
+
+static void offer(std::vector<sim_client_t> &clients, const sim_msg_t &msg) {
+  sim_msg_t out[WS_CLIENT_PENDING_MAX + 1];
+  for (sim_client_t &c : clients) {
+    size_t n = ws_throttle_update(&c.throttle, c.queue.size(), msg,
+                                  msg.essential, out);
+    for (size_t i = 0; i < n; ++i) {
+      if (c.queue.size() >= SIM_LIB_QUEUE_MAX) {
+        c.lost++;
+      } else {
+        c.queue.push_back(out[i]);
+      }
+    }
+  }
+}
+
+static void drain(std::vector<sim_client_t> &clients, int tick,
+                  const std::vector<sim_stall_t> &stalls) {
+  long budget = SIM_UPLINK_BYTES_PER_S * SIM_TICK_MS / 1000;
+  for (size_t i = 0; i < clients.size(); ++i) {
+    bool stalled = false;
+    for (const sim_stall_t &s : stalls) {
+      stalled |= s.client == i && tick >= s.from && tick < s.to;
+    }
+    long add = stalled ? 0 : clients[i].bytes_per_s * SIM_TICK_MS / 1000;
+    // Credit does not bank up beyond a tick's worth plus one message.
+    clients[i].credit =
+        std::min(clients[i].credit + add, add + SIM_LEADERBOARD_BYTES);
+  }
+
+  // The device serves client queues round-robin, one message at a time.
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (sim_client_t &c : clients) {
+      if (c.queue.empty()) continue;
+      long bytes = c.queue.front().bytes;
+      if (bytes > c.credit || bytes > budget) continue;
+      sim_msg_t msg = c.queue.front();
+      c.queue.pop_front();
+      c.credit -= bytes;
+      budget -= bytes;
+      progress = true;
+      if (msg.essential) {
+        c.essential_received++;
+        if (msg.seq < c.last_essential_seq) c.essential_out_of_order = true;
+        c.last_essential_seq = msg.seq;
+      } else {
+        c.status_received++;
+      }
+    }
+  }
+}
+
+static sim_result_t simulate(std::vector<sim_client_t> &clients,
+                             const std::vector<sim_stall_t> &stalls = {}) {
+  sim_result_t result;
+  int seq = 0;
+  for (int tick = 0; tick < SIM_TICKS + SIM_TAIL_TICKS; ++tick) {
+    bool counted = tick < SIM_TICKS;
+    // After a finish app_task sends the finish status, the leaderboard and
+    // the event batch back to back, all essential.
+    bool finish =
+        counted && tick % SIM_FINISH_EVERY_TICKS == SIM_FINISH_EVERY_TICKS - 1;
+    if (finish) {
+      const size_t sizes[] = {SIM_FINISH_BYTES, SIM_LEADERBOARD_BYTES,
+                              SIM_EVENTS_BYTES};
+      for (size_t bytes : sizes) {
+        sim_msg_t msg;
+        msg.seq = ++seq;
+        msg.essential = true;
+        msg.bytes = bytes;
+        offer(clients, msg);
+        result.essential_sent++;
+      }
+    } else {
+      sim_msg_t msg;
+      msg.seq = ++seq;
+      msg.bytes = SIM_STATUS_BYTES;
+      offer(clients, msg);
+      result.status_sent++;
+    }
+    drain(clients, tick, stalls);
+  }
+  return result;
+}
+
+static std::vector<sim_client_t> make_clients(size_t n, long bytes_per_s) {
+  std::vector<sim_client_t> clients(n);
+  for (sim_client_t &c : clients) c.bytes_per_s = bytes_per_s;
+  return clients;
+}
+
+static bool all_essentials_delivered(const std::vector<sim_client_t> &clients,
+                                     const sim_result_t &result) {
+  for (const sim_client_t &c : clients) {
+    if (c.essential_received != result.essential_sent || c.lost ||
+        c.throttle.dropped || c.essential_out_of_order) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Largest number of identical healthy viewers for which every client still
+// gets at least `min_fraction` of the status updates and every essential
+// message.
+static size_t sustained_viewers(double min_fraction) {
+  size_t best = 0;
+  for (size_t n = 1; n <= 64; ++n) {
+    std::vector<sim_client_t> clients =
+        make_clients(n, SIM_FAST_CLIENT_BYTES_PER_S);
+    sim_result_t result = simulate(clients);
+    bool ok = all_essentials_delivered(clients, result);
+    for (const sim_client_t &c : clients) {
+      ok &= c.status_received >= min_fraction * result.status_sent;
+    }
+    if (!ok) break;
+    best = n;
+  }
+  return best;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_essential_waits_while_congested() {
+  ws_throttle_t<int> t;
+  int out[WS_CLIENT_PENDING_MAX + 1];
+  TEST_ASSERT_EQUAL(0, ws_throttle_update(&t, WS_CLIENT_QUEUE_CONGESTED, 1,
+                                          true, out));
+  TEST_ASSERT_EQUAL(0, ws_throttle_update(&t, WS_CLIENT_QUEUE_CONGESTED, 2,
+                                          true, out));
+  TEST_ASSERT_EQUAL(2, t.pending_count);
+
+  // Once the queue drains the held messages go out first, in order.
+  size_t n = ws_throttle_update(&t, 0, 3, true, out);
+  TEST_ASSERT_EQUAL(3, n);
+  TEST_ASSERT_EQUAL(1, out[0]);
+  TEST_ASSERT_EQUAL(2, out[1]);
+  TEST_ASSERT_EQUAL(3, out[2]);
+  TEST_ASSERT_EQUAL(0, t.dropped);
+}
+
+void test_fifo_overflow_drops_oldest() {
+  ws_throttle_t<int> t;
+  int out[WS_CLIENT_PENDING_MAX + 1];
+  for (int i = 1; i <= WS_CLIENT_PENDING_MAX + 2; ++i) {
+    ws_throttle_update(&t, WS_CLIENT_QUEUE_CONGESTED, i, true, out);
+  }
+  TEST_ASSERT_EQUAL(2, t.dropped);
+  TEST_ASSERT_EQUAL(WS_CLIENT_QUEUE_CONGESTED,
+                    ws_throttle_update(&t, 0, 0, false, out));
+  TEST_ASSERT_EQUAL(3, out[0]);
+}
+
+void test_congestion_reduces_then_restores_rate() {
+  ws_throttle_t<int> t;
+  int out[WS_CLIENT_PENDING_MAX + 1];
+  for (int i = 0; i < 8; ++i) {
+    ws_throttle_update(&t, WS_CLIENT_QUEUE_CONGESTED, 1, false, out);
+  }
+  TEST_ASSERT_EQUAL(WS_CLIENT_MAX_DIVISOR, t.divisor);
+  for (int i = 0; i < 8; ++i) ws_throttle_update(&t, 0, 1, false, out);
+  TEST_ASSERT_EQUAL(1, t.divisor);
+}
+
+void test_slow_client_does_not_slow_healthy_clients() {
+  std::vector<sim_client_t> clients =
+      make_clients(10, SIM_FAST_CLIENT_BYTES_PER_S);
+  clients[0].bytes_per_s = 2000;
+  sim_result_t result = simulate(clients);
+
+  TEST_ASSERT_TRUE(all_essentials_delivered(clients, result));
+  for (size_t i = 1; i < clients.size(); ++i) {
+    TEST_ASSERT_EQUAL(result.status_sent, clients[i].status_received);
+  }
+  TEST_ASSERT_TRUE(clients[0].status_received < result.status_sent / 2);
+  TEST_ASSERT_TRUE(clients[0].status_received > 0);
+}
+
+void test_stalled_client_gets_held_essentials() {
+  std::vector<sim_client_t> clients =
+      make_clients(4, SIM_FAST_CLIENT_BYTES_PER_S);
+  // Stalled across a finish, like a phone briefly off the AP.
+  std::vector<sim_stall_t> stalls = {{0, 80, 130}};
+  sim_result_t result = simulate(clients, stalls);
+
+  TEST_ASSERT_TRUE(all_essentials_delivered(clients, result));
+  TEST_ASSERT_EQUAL(1, clients[0].throttle.divisor);
+  TEST_ASSERT_EQUAL(result.status_sent, clients[1].status_received);
+}
+
+void test_sustained_viewer_count() {
+  size_t full_rate = sustained_viewers(1.0);
+  // One update in ten is one a second.
+  size_t degraded = sustained_viewers(0.1);
+  char msg[160];
+  snprintf(msg, sizeof(msg),
+           "%zu viewers at full rate, %zu at >= 1 update/s; firmware admits "
+           "%d",
+           full_rate, degraded, WS_MAX_CLIENTS);
+  TEST_MESSAGE(msg);
+
+  TEST_ASSERT_TRUE(full_rate >= WS_MAX_CLIENTS);
+  TEST_ASSERT_TRUE(degraded >= full_rate);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_essential_waits_while_congested);
+  RUN_TEST(test_fifo_overflow_drops_oldest);
+  RUN_TEST(test_congestion_reduces_then_restores_rate);
+  RUN_TEST(test_slow_client_does_not_slow_healthy_clients);
+  RUN_TEST(test_stalled_client_gets_held_essentials);
+  RUN_TEST(test_sustained_viewer_count);
+  return UNITY_END();
+}